@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -17,9 +19,15 @@ typedef unsigned char bmap;
 #define BM_CLR(d, set) ((set[__BMELT(d)] &= ~__BMMASK(d)))
 #define BM_ISSET(d, set) ((set[__BMELT(d)] & __BMMASK(d)) != 0)
 
+#define NDIR_BLOCKS 12 // direct blocks in i_block[]
+#define IND_BLOCK 12   // single indirect
+#define DIND_BLOCK 13  // double indirect
+#define TIND_BLOCK 14  // triple indirect
+
 unsigned int block_size = 0;
 static unsigned int num_inodes_per_group = 0; // to be read in
-#define BLOCK_OFFSET(block) (BASE_OFFSET + (block - 1) * block_size)
+static unsigned int inode_size = 0;           // to be read in
+#define BLOCK_OFFSET(block) ((off_t)(block) * block_size)
 // void moveBlocks(int,int);
 
 // static void read_inode(int, const struct ext2_group_desc *, int,
@@ -32,17 +40,465 @@ void moveBlocks(int *xp, int *yp)
     *yp = a;
 }
 
+// one block the access trace reads, in first-access order: a data block or
+// a pointer block walked through to reach one
+struct trace_block
+{
+    unsigned int inode;  // inode number
+    unsigned int lblock; // logical block of the first access through it
+    unsigned int block;  // physical block on the image
+    unsigned int level;  // 0 data, 1/2/3 single/double/triple indirect
+    int parent;          // entry holding the pointer to it, -1 for the inode
+    unsigned int slot;   // index of that pointer in i_block[] or the parent
+};
+
+static const char *level_names[] = {"data", "ind", "dind", "tind"};
+
+// reads/writes `len` bytes at `offset`, returns -1 on a short transfer
+static int read_at(int fd, off_t offset, void *buffer, size_t len)
+{
+    if (lseek(fd, offset, SEEK_SET) < 0 || read(fd, buffer, len) != (ssize_t)len)
+        return -1;
+    return 0;
+}
+
+static int write_at(int fd, off_t offset, const void *buffer, size_t len)
+{
+    if (lseek(fd, offset, SEEK_SET) < 0 || write(fd, buffer, len) != (ssize_t)len)
+        return -1;
+    return 0;
+}
+
+static off_t inode_offset(const struct ext2_group_desc *group, unsigned int inode_no)
+{
+    unsigned int group_no = (inode_no - 1) / num_inodes_per_group;
+    unsigned int index = (inode_no - 1) % num_inodes_per_group;
+    return BLOCK_OFFSET(group[group_no].bg_inode_table) + (off_t)index * inode_size;
+}
+
+// returns -1 if the inode could not be read
+static int read_inode(int fd, const struct ext2_group_desc *group, unsigned int inode_no,
+                      struct ext2_inode *inode)
+{
+    return read_at(fd, inode_offset(group, inode_no), inode, sizeof(struct ext2_inode));
+}
+
+// reads entry `index` of the pointer block `block` into `ptr` (0 for a
+// hole), returns -1 if the pointer block could not be read
+static int read_block_ptr(int fd, unsigned int block, unsigned int index, unsigned int *ptr)
+{
+    *ptr = 0;
+    if (block == 0)
+        return 0;
+    return read_at(fd, BLOCK_OFFSET(block) + (off_t)index * sizeof(*ptr), ptr, sizeof(*ptr));
+}
+
+// walks the block map of an inode to logical block `lblock`. The blocks on
+// the way go to `chain`, pointer blocks first and the data block last, and
+// the index each one has in i_block[] or in the block before it goes to
+// `slots`. Returns the chain length, or -1 if `lblock` is past the map or a
+// pointer block is unreadable. A 0 in the chain is a hole.
+static int map_block(int fd, const struct ext2_inode *inode, unsigned int lblock,
+                     unsigned int *chain, unsigned int *slots)
+{
+    unsigned int ptrs = block_size / sizeof(unsigned int);
+    int depth, k;
+
+    if (lblock < NDIR_BLOCKS)
+    {
+        depth = 1;
+        slots[0] = lblock;
+    }
+    else if ((lblock -= NDIR_BLOCKS) < ptrs)
+    {
+        depth = 2;
+        slots[0] = IND_BLOCK;
+        slots[1] = lblock;
+    }
+    else if ((lblock -= ptrs) < ptrs * ptrs)
+    {
+        depth = 3;
+        slots[0] = DIND_BLOCK;
+        slots[1] = lblock / ptrs;
+        slots[2] = lblock % ptrs;
+    }
+    else
+    {
+        lblock -= ptrs * ptrs;
+        if (lblock / (ptrs * ptrs) >= ptrs)
+            return -1;
+        depth = 4;
+        slots[0] = TIND_BLOCK;
+        slots[1] = lblock / (ptrs * ptrs);
+        slots[2] = (lblock / ptrs) % ptrs;
+        slots[3] = lblock % ptrs;
+    }
+    chain[0] = inode->i_block[slots[0]];
+    for (k = 1; k < depth; k++)
+        if (read_block_ptr(fd, chain[k - 1], slots[k], &chain[k]) < 0)
+            return -1;
+    return depth;
+}
+
+// reads the block bitmap of every group into one buffer, group after group
+static bmap *read_bitmaps(int fd, const struct ext2_super_block *super,
+                          const struct ext2_group_desc *group)
+{
+    unsigned int num_groups = (super->s_blocks_count + super->s_blocks_per_group - 1) / super->s_blocks_per_group;
+    unsigned int g;
+    bmap *bitmaps;
+
+    if ((bitmaps = malloc((size_t)num_groups * block_size)) == NULL)
+        return NULL;
+    for (g = 0; g < num_groups; g++)
+        if (read_at(fd, BLOCK_OFFSET(group[g].bg_block_bitmap), bitmaps + (size_t)g * block_size, block_size) < 0)
+        {
+            free(bitmaps);
+            return NULL;
+        }
+    return bitmaps;
+}
+
+static int block_in_use(const struct ext2_super_block *super, const bmap *bitmaps, unsigned int block)
+{
+    unsigned int rel;
+    const bmap *bitmap;
+    // blocks in front of the first group (the boot block) are never free
+    if (block < super->s_first_data_block)
+        return 1;
+    rel = block - super->s_first_data_block;
+    bitmap = bitmaps + (size_t)(rel / super->s_blocks_per_group) * block_size;
+    return BM_ISSET(rel % super->s_blocks_per_group, bitmap);
+}
+
+// moves the bit of `block` in the bitmaps and the group's free count
+static void mark_block(const struct ext2_super_block *super, bmap *bitmaps,
+                       struct ext2_group_desc *group, unsigned int block, int used)
+{
+    unsigned int rel = block - super->s_first_data_block;
+    unsigned int g = rel / super->s_blocks_per_group;
+    bmap *bitmap = bitmaps + (size_t)g * block_size;
+
+    if (used)
+    {
+        BM_SET(rel % super->s_blocks_per_group, bitmap);
+        group[g].bg_free_blocks_count--;
+    }
+    else
+    {
+        BM_CLR(rel % super->s_blocks_per_group, bitmap);
+        group[g].bg_free_blocks_count++;
+    }
+}
+
+// Copies every trace entry to block `start` + its position, repoints the
+// inode or pointer block that refers to it and moves its bitmap bit. A
+// parent is always earlier in the list than its children, so it has already
+// been copied when the pointer inside it is rewritten. The targets are free
+// blocks, so no copy overwrites a block that is still to be read. The block
+// totals do not change: every block taken is matched by one freed.
+static int relocate_trace(int fd, const struct ext2_super_block *super, struct ext2_group_desc *group,
+                          bmap *bitmaps, const struct trace_block *blocks, unsigned int count,
+                          unsigned int start)
+{
+    unsigned int num_groups = (super->s_blocks_count + super->s_blocks_per_group - 1) / super->s_blocks_per_group;
+    unsigned char *buffer;
+    struct ext2_inode inode;
+    unsigned int i, target;
+    off_t offset;
+    int ret = -1;
+
+    if ((buffer = malloc(block_size)) == NULL)
+        return -1;
+    for (i = 0; i < count; i++)
+    {
+        target = start + i;
+        if (read_at(fd, BLOCK_OFFSET(blocks[i].block), buffer, block_size) < 0 ||
+            write_at(fd, BLOCK_OFFSET(target), buffer, block_size) < 0)
+            goto out;
+        if (blocks[i].parent < 0)
+        {
+            offset = inode_offset(group, blocks[i].inode);
+            if (read_at(fd, offset, &inode, sizeof(inode)) < 0)
+                goto out;
+            inode.i_block[blocks[i].slot] = target;
+            if (write_at(fd, offset, &inode, sizeof(inode)) < 0)
+                goto out;
+        }
+        else
+        {
+            offset = BLOCK_OFFSET(start + blocks[i].parent) + (off_t)blocks[i].slot * sizeof(target);
+            if (write_at(fd, offset, &target, sizeof(target)) < 0)
+                goto out;
+        }
+        mark_block(super, bitmaps, group, target, 1);
+        mark_block(super, bitmaps, group, blocks[i].block, 0);
+    }
+    for (i = 0; i < num_groups; i++)
+        if (write_at(fd, BLOCK_OFFSET(group[i].bg_block_bitmap), bitmaps + (size_t)i * block_size, block_size) < 0)
+            goto out;
+    if (write_at(fd, BLOCK_OFFSET(super->s_first_data_block + 1), group,
+                 num_groups * sizeof(struct ext2_group_desc)) < 0)
+        goto out;
+    ret = fsync(fd);
+
+out:
+    free(buffer);
+    return ret;
+}
+
+// the rest of a trace line after a number may only be blank
+static int blank(const char *s)
+{
+    return s[strspn(s, " \t\r\n")] == '\0';
+}
+
+// parses a "<inode> <byte offset>" trace line, returns -1 if it is malformed
+static int parse_trace_line(const char *line, unsigned long *inode_no, unsigned long long *offset)
+{
+    char *end;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (*line < '0' || *line > '9')
+        return -1;
+    errno = 0;
+    *inode_no = strtoul(line, &end, 10);
+    if (errno == ERANGE || end == line || (*end != ' ' && *end != '\t'))
+        return -1;
+    line = end;
+    while (*line == ' ' || *line == '\t')
+        line++;
+    // strtoull() would accept and wrap a leading '-'
+    if (*line < '0' || *line > '9')
+        return -1;
+    errno = 0;
+    *offset = strtoull(line, &end, 10);
+    if (errno == ERANGE || end == line || !blank(end))
+        return -1;
+    return 0;
+}
+
+// reports a trace line that is left out of the layout and counts it
+static void skip_line(const char *trace_file, unsigned int line_no, unsigned int *skipped,
+                      const char *format, ...)
+{
+    va_list args;
+
+    fprintf(stderr, "%s:%u: ", trace_file, line_no);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, ", skipped\n");
+    (*skipped)++;
+}
+
+// Reads an access trace of "<inode> <byte offset>" lines and lays out every
+// block they read contiguously, in first-access order and across files, so
+// a cold start becomes one sequential read. The pointer blocks walked to
+// reach a data block are placed in front of it, as they are read first.
+// The target run is taken from free space only. Without `apply` the layout
+// is only printed; with it the blocks are moved on the image.
+static int replay_trace(int fd, const char *trace_file, const struct ext2_super_block *super,
+                        struct ext2_group_desc *group, int apply)
+{
+    FILE *trace;
+    char line[256];
+    struct trace_block *blocks = NULL;
+    struct ext2_inode inode;
+    unsigned long inode_no;
+    unsigned long long offset, size, lblock;
+    unsigned int count = 0, capacity = 0, line_no = 0, skipped = 0;
+    unsigned int chain[4], slots[4];
+    unsigned int start, run, b, i;
+    unsigned int seeks_before = 0;
+    unsigned short type;
+    unsigned int *placed = NULL; // entry index + 1 of each placed block
+    bmap *bitmaps = NULL;
+    int depth, k;
+    int ret = 1;
+
+    if ((trace = fopen(trace_file, "r")) == NULL)
+    {
+        perror(trace_file);
+        return 1;
+    }
+    if ((placed = calloc(super->s_blocks_count, sizeof(unsigned int))) == NULL)
+    {
+        fprintf(stderr, "Memory error\n");
+        goto out;
+    }
+
+    while (fgets(line, sizeof(line), trace) != NULL)
+    {
+        line_no++;
+        if (blank(line) || line[strspn(line, " \t")] == '#')
+            continue; // blank lines, comments
+        if (parse_trace_line(line, &inode_no, &offset) < 0)
+        {
+            skip_line(trace_file, line_no, &skipped, "malformed trace line");
+            continue;
+        }
+        if (inode_no == 0 || inode_no > super->s_inodes_count)
+        {
+            skip_line(trace_file, line_no, &skipped, "no inode %lu", inode_no);
+            continue;
+        }
+        if (read_inode(fd, group, inode_no, &inode) < 0)
+        {
+            skip_line(trace_file, line_no, &skipped, "cannot read inode %lu", inode_no);
+            continue;
+        }
+        // deleted inodes keep their size and block map, so check the links
+        // and deletion time; only regular files and directories have a
+        // block map (fast symlinks keep the link text in i_block[])
+        type = inode.i_mode & 0xF000;
+        if (inode.i_links_count == 0 || inode.i_dtime != 0)
+        {
+            skip_line(trace_file, line_no, &skipped, "inode %lu is deleted", inode_no);
+            continue;
+        }
+        if (type != EXT2_S_IFREG && type != EXT2_S_IFDIR)
+        {
+            skip_line(trace_file, line_no, &skipped, "inode %lu is not a file or directory", inode_no);
+            continue;
+        }
+        size = inode.i_size;
+        if (type == EXT2_S_IFREG)
+            size |= (unsigned long long)inode.i_dir_acl << 32; // high 32 bits
+        lblock = offset / block_size;
+        if (offset >= size || lblock > 0xFFFFFFFFULL)
+        {
+            skip_line(trace_file, line_no, &skipped, "offset %llu is past the end of inode %lu",
+                      offset, inode_no);
+            continue;
+        }
+        if ((depth = map_block(fd, &inode, (unsigned int)lblock, chain, slots)) < 0)
+        {
+            skip_line(trace_file, line_no, &skipped, "cannot map block %llu of inode %lu",
+                      lblock, inode_no);
+            continue;
+        }
+        for (k = 0; k < depth; k++)
+            if (chain[k] < super->s_first_data_block || chain[k] >= super->s_blocks_count)
+                break;
+        if (k < depth)
+        {
+            if (chain[k] == 0)
+                skip_line(trace_file, line_no, &skipped, "block %llu of inode %lu is a hole",
+                          lblock, inode_no);
+            else
+                skip_line(trace_file, line_no, &skipped, "corrupt block pointer %u in inode %lu",
+                          chain[k], inode_no);
+            continue;
+        }
+
+        for (k = 0; k < depth; k++)
+        {
+            if (placed[chain[k]])
+                continue; // read earlier in the trace
+            if (count == capacity)
+            {
+                struct trace_block *grown;
+                capacity = capacity ? capacity * 2 : 64;
+                if ((grown = realloc(blocks, capacity * sizeof(struct trace_block))) == NULL)
+                {
+                    fprintf(stderr, "Memory error\n");
+                    goto out;
+                }
+                blocks = grown;
+            }
+            blocks[count].inode = inode_no;
+            blocks[count].lblock = lblock;
+            blocks[count].block = chain[k];
+            blocks[count].level = depth - 1 - k;
+            blocks[count].parent = k == 0 ? -1 : (int)placed[chain[k - 1]] - 1;
+            blocks[count].slot = slots[k];
+            if (count > 0 && blocks[count - 1].block + 1 != chain[k])
+                seeks_before++;
+            placed[chain[k]] = ++count;
+        }
+    }
+
+    if (count == 0)
+    {
+        fprintf(stderr, "No mapped blocks in trace %s\n", trace_file);
+        goto out;
+    }
+    if (seeks_before == 0)
+    {
+        printf("Trace %s is already one sequential run of %u blocks\n", trace_file, count);
+        ret = 0;
+        goto out;
+    }
+
+    if ((bitmaps = read_bitmaps(fd, super, group)) == NULL)
+    {
+        fprintf(stderr, "Cannot read block bitmaps\n");
+        goto out;
+    }
+
+    // first run of free blocks anywhere on the image long enough to hold the
+    // whole trace; the trace's own blocks stay allocated until copied
+    run = 0;
+    start = 0;
+    for (b = 0; b < super->s_blocks_count && run < count; b++)
+    {
+        if (block_in_use(super, bitmaps, b))
+            run = 0;
+        else if (run++ == 0)
+            start = b;
+    }
+    if (run < count)
+    {
+        fprintf(stderr, "No free run of %u blocks for the trace\n", count);
+        goto out;
+    }
+
+    printf("Trace layout from %s%s:\n"
+           "inode  lblock  kind  block -> new\n",
+           trace_file, apply ? "" : " (plan only, image not modified)");
+    for (i = 0; i < count; i++)
+        printf("%5u %7u %5s %6u -> %u\n", blocks[i].inode, blocks[i].lblock,
+               level_names[blocks[i].level], blocks[i].block, start + i);
+    printf("\nTrace blocks            : %u\n"
+           "Skipped trace lines     : %u\n"
+           "Seeks before / after    : %u / 0\n",
+           count, skipped, seeks_before);
+
+    if (apply)
+    {
+        if (relocate_trace(fd, super, group, bitmaps, blocks, count, start) < 0)
+        {
+            perror("Relocating trace blocks");
+            goto out;
+        }
+        printf("Moved %u blocks to %u-%u\n", count, start, start + count - 1);
+    }
+    ret = 0;
+
+out:
+    fclose(trace);
+    free(blocks);
+    free(placed);
+    free(bitmaps);
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
     struct ext2_super_block super;
     struct ext2_group_desc *group;
     int fd, i;
-    if (argc < 2)
+    int apply = argc > 3 && strcmp(argv[3], "--apply") == 0;
+    if (argc < 2 || argc > 4 || (argc == 4 && !apply))
     {
-        fprintf(stderr, "Error in command line arguments.Please give the name of the imagefile\n");
+        fprintf(stderr, "Error in command line arguments.Please give the name of the imagefile\n"
+                        "Usage: %s <imagefile> [tracefile [--apply]]\n",
+                argv[0]);
         exit(1);
     }
-    if ((fd = open(argv[1], O_RDONLY)) < 0)
+    if ((fd = open(argv[1], apply ? O_RDWR : O_RDONLY)) < 0)
     {
         perror(argv[1]);
         exit(1);
@@ -58,6 +514,7 @@ int main(int argc, char *argv[])
     }
     block_size = 1024 << super.s_log_block_size;
     num_inodes_per_group = super.s_inodes_per_group;
+    inode_size = super.s_rev_level == 0 ? 128 : super.s_inode_size;
 
     int num_groups = (super.s_blocks_count + super.s_blocks_per_group - 1) / super.s_blocks_per_group;
 
@@ -70,11 +527,21 @@ int main(int argc, char *argv[])
     }
     for (i = 0; i < num_groups; i++)
     {
-        printf("Reading group # %u\n", i);
-        lseek(fd, BASE_OFFSET + block_size + i * sizeof(struct ext2_group_desc), SEEK_SET);
+        if (argc < 3)
+            printf("Reading group # %u\n", i);
+        lseek(fd, BLOCK_OFFSET(super.s_first_data_block + 1) + i * sizeof(struct ext2_group_desc), SEEK_SET);
         read(fd, group + i, sizeof(struct ext2_group_desc));
     }
 
+    // lay out the blocks of an access trace instead of defragmenting
+    if (argc > 2)
+    {
+        int ret = replay_trace(fd, argv[2], &super, group, apply);
+        free(group);
+        close(fd);
+        return ret;
+    }
+
     printf("\nReading from image file %s:\n"
            "Blocks count            : %u\n"
            "First non-reserved inode: %u\n"
@@ -85,7 +552,7 @@ int main(int argc, char *argv[])
            super.s_first_ino, super.s_inodes_count, super.s_free_inodes_count, num_groups);
 
     // read group descriptor
-    lseek(fd, BASE_OFFSET + block_size, SEEK_SET);
+    lseek(fd, BLOCK_OFFSET(super.s_first_data_block + 1), SEEK_SET);
     read(fd, group, sizeof(group));
 
     // read block bitmap
@@ -96,7 +563,8 @@ int main(int argc, char *argv[])
     int fr = 0;
     int nfr = 0;
     printf("Free block bitmap:\n");
-    for (i = 0; i < super.s_blocks_count; i++)
+    // the bitmap read above only covers the first group
+    for (i = 0; i < super.s_blocks_per_group && i < super.s_blocks_count; i++)
     {
         if (BM_ISSET(i, bitmap))
         {
@@ -113,6 +581,7 @@ int main(int argc, char *argv[])
     printf("\nFree blocks count       : %u\n"
            "Non-Free block count    : %u\n",
            fr, nfr);
+
     free(bitmap);
 
     int inodes[super.s_inodes_count * 15];
@@ -188,6 +657,7 @@ int main(int argc, char *argv[])
         read(fd, &inode, sizeof(struct ext2_inode));
         printf("%u %u\n", inodes[i] + 1, block_a[i]);
     }
+    free(group);
     close(fd);
     return 0;
 }